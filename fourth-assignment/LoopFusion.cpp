@@ -1,6 +1,10 @@
 #include "llvm/Transforms/Utils/LoopFusion.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ValueTracking.h"
 
 #include <set>
 
@@ -68,6 +72,35 @@ BasicBlock* getBody(Loop* L) {
     return (dyn_cast<BranchInst>(L->getHeader()->getTerminator()))->getSuccessor(0); 
 }
 
+/*
+fuseLoops expects the loop to go header -> body -> latch, with the header as the only exiting block
+and the canonical induction variable as its only PHI; the other header instructions are dropped, so
+they can only be used inside the header itself
+*/
+bool hasFusableShape(Loop* L){
+    BasicBlock* Header = L->getHeader();
+    PHINode* iv = L->getCanonicalInductionVariable();
+
+    if (!iv || Header == L->getLoopLatch() || L->getExitingBlock() != Header)
+        return false;
+
+    BranchInst* HeaderBranch = dyn_cast<BranchInst>(Header->getTerminator());
+    if (!HeaderBranch || !HeaderBranch->isConditional() || !L->contains(getBody(L)))
+        return false;
+
+    for (auto& Phi : Header->phis())
+        if (&Phi != iv)
+            return false;
+
+    for (auto& Inst : *Header){
+        if (isa<PHINode>(Inst) || Inst.isTerminator())
+            continue;
+        if (!all_of(Inst.users(), [Header](User* U){ return cast<Instruction>(U)->getParent() == Header; }))
+            return false;
+    }
+    return true;
+}
+
 bool haveNegDistanceDependence( DependenceInfo &DI,ScalarEvolution& SE, Loop* L1, Loop* L2){
     /*BasicBlock* Body1 = getBody(L1);
     BasicBlock* Body2 = getBody(L2);
@@ -96,6 +129,52 @@ bool haveNegDistanceDependence( DependenceInfo &DI,ScalarEvolution& SE, Loop* L1
     return false;
 }
 
+/*
+An instruction can be moved to another block if it doesn't touch memory, can be speculated and
+all its instruction operands are available there
+*/
+bool isHoistableInstruction(Instruction &Inst, function_ref<bool(Instruction*)> isAvailable){
+    if (isa<PHINode>(Inst) || Inst.mayReadOrWriteMemory() || !isSafeToSpeculativelyExecute(&Inst))
+        return false;
+    for (auto& Op : Inst.operands())
+        if (Instruction* OpInst = dyn_cast<Instruction>(Op))
+            if (!isAvailable(OpInst))
+                return false;
+    return true;
+}
+
+/*
+The L2 preheader is dropped when L2 is fused into L1, so whatever it computes has to be moved
+at the end of the L1 preheader (e.g. the outer induction variable update left between two inner
+loops copies by the unrolling)
+*/
+bool isPreheaderHoistable(DominatorTree &DT, Loop* L1, Loop* L2){
+    BasicBlock* Preheader1 = L1->getLoopPreheader();
+    BasicBlock* Preheader2 = L2->getLoopPreheader();
+
+    if (!Preheader1 || !Preheader2)
+        return false;
+
+    auto dominatesPreheader1 = [&DT, Preheader1](Instruction* OpInst){
+        return DT.dominates(OpInst, Preheader1->getTerminator());
+    };
+    for (auto& Inst : *Preheader2)
+        if (!Inst.isTerminator() && !isHoistableInstruction(Inst, dominatesPreheader1))
+            return false;
+    return true;
+}
+
+/*
+Move the instructions of the L2 preheader at the end of the L1 preheader
+*/
+void hoistPreheaderInstructions(Loop* L1, Loop* L2){
+    BasicBlock* Preheader1 = L1->getLoopPreheader();
+    BasicBlock* Preheader2 = L2->getLoopPreheader();
+
+    while (&Preheader2->front() != Preheader2->getTerminator())
+        Preheader2->front().moveBefore(Preheader1->getTerminator());
+}
+
 /*
 Replace the uses of the L2 induction variable with the L1 induction variable
 */
@@ -110,6 +189,7 @@ void replaceUsesInductionVariable(Loop* L1, Loop* L2) {
 Function used to fuse two loops
 */
 void fuseLoops(Loop* L1, Loop* L2, LoopInfo& LI){
+    hoistPreheaderInstructions(L1,L2);
     replaceUsesInductionVariable(L1,L2);
 
     //Retrieve Loop2 Body
@@ -143,14 +223,30 @@ void fuseLoops(Loop* L1, Loop* L2, LoopInfo& LI){
     // L2 Header links to L2 Latch
     Header2->getTerminator()->replaceSuccessorWith(Body2, Latch2);
 
-    for (auto& BB : L2->blocks())
-        if(BB != Header2 && BB != Latch2)
-            L1->addBasicBlockToLoop(BB,LI);
+    // L2 Body blocks are moved in L1: the parent loops (if any) already contain them,
+    // while the blocks of L2 subloops keep their innermost loop
+    std::vector<BasicBlock*> Body2Blocks(L2->block_begin(), L2->block_end());
+    for (auto& BB : Body2Blocks)
+        if(BB != Header2 && BB != Latch2){
+            L2->removeBlockFromLoop(BB);
+            L1->addBlockEntry(BB);
+            if (LI.getLoopFor(BB) == L2)
+                LI.changeLoopFor(BB, L1);
+        }
+
+    // L2 subloops become L1 subloops
+    while (!L2->isInnermost())
+        L1->addChildLoop(L2->removeChildLoop(L2->begin()));
 
     LI.erase(L2); 
 }
 
 void printDetails(ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, Loop* firstLoop, Loop* secondLoop){
+    if(hasFusableShape(firstLoop) && hasFusableShape(secondLoop))
+        outs()<<"Have fusable shape\n";
+    else
+        outs()<<"Have NOT fusable shape\n";
+
     if(areAdjacentBlocks(firstLoop, secondLoop)) 
         outs()<<"Are adiacent\n";
     else
@@ -171,9 +267,26 @@ void printDetails(ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT
     else 
         outs()<<"Have negative distance depencedencies\n";
 
+    if(isPreheaderHoistable(DT, firstLoop, secondLoop))
+        outs()<<"Preheader is hoistable\n";
+    else
+        outs()<<"Preheader is NOT hoistable\n";
 
 }
 
+/*
+All the conditions under which L2 can be fused into L1
+*/
+bool canBeFused(ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, Loop* L1, Loop* L2){
+    return hasFusableShape(L1)
+        && hasFusableShape(L2)
+        && areAdjacentBlocks(L1, L2)
+        && haveSameTripCount(SE, L1, L2)
+        && areControlFlowEquivalent(DT, PDT, L1, L2)
+        && !haveNegDistanceDependence(DI, SE, L1, L2)
+        && isPreheaderHoistable(DT, L1, L2);
+}
+
 /*
 Function used to check if a loop can be fused, controlling its fundamental blocks and if it's in simplified form
 */
@@ -221,10 +334,7 @@ PreservedAnalyses LoopFusion::run(Function &F,FunctionAnalysisManager &AM) {
         outs()<<"L2:\n";
         TopLevelLoop->print(outs());
         printDetails(SE, DT, PDT, DI, firstLoop, TopLevelLoop);
-        if (areAdjacentBlocks(firstLoop, TopLevelLoop)
-            && haveSameTripCount(SE, firstLoop, TopLevelLoop)
-            && areControlFlowEquivalent(DT, PDT, firstLoop, TopLevelLoop)
-            && !haveNegDistanceDependence(DI, SE, firstLoop, TopLevelLoop)){
+        if (canBeFused(SE, DT, PDT, DI, firstLoop, TopLevelLoop)){
             
             fuseLoops(firstLoop, TopLevelLoop, LI);
             EliminateUnreachableBlocks(F);
@@ -238,4 +348,223 @@ PreservedAnalyses LoopFusion::run(Function &F,FunctionAnalysisManager &AM) {
     }
     
 	return PreservedAnalyses::all();
-}
\ No newline at end of file
+}
+
+/*
+Unroll-and-jam is only applied to the two innermost loops of a perfect nest: the outer loop contains
+a single innermost loop and, apart from its header and latch, the only outer blocks are the inner
+preheader and exit, which must be empty
+*/
+bool isPerfectNest(Loop* Outer){
+    if (Outer->getSubLoops().size() != 1)
+        return false;
+
+    Loop* Inner = Outer->getSubLoops().front();
+    if (!Inner->isInnermost() || !isEligibleForFusion(Outer) || !isEligibleForFusion(Inner) || !hasFusableShape(Inner))
+        return false;
+
+    for (auto& BB : Outer->blocks()){
+        if (Inner->contains(BB) || BB == Outer->getHeader() || BB == Outer->getLoopLatch())
+            continue;
+        if (BB != Inner->getLoopPreheader() && BB != Inner->getExitBlock())
+            return false;
+        if (BB->size() != 1)
+            return false;
+    }
+    return true;
+}
+
+/*
+Jamming the copies of the inner loop moves the iteration (i+k, j) before the iteration (i, j+1):
+it's illegal if a dependence goes from an earlier outer iteration to an earlier inner
+iteration, i.e. it has direction (<, >)
+*/
+bool haveJamPreventingDependence(DependenceInfo &DI, Loop* Outer, Loop* Inner){
+    std::vector<Instruction*> memInstructions;
+    unsigned outerLevel = Outer->getLoopDepth();
+    unsigned innerLevel = outerLevel + 1;
+
+    for (auto& BB : Inner->blocks())
+        for (auto& Inst : *BB){
+            if (isa<LoadInst>(Inst) || isa<StoreInst>(Inst))
+                memInstructions.push_back(&Inst);
+            else if (Inst.mayReadOrWriteMemory())
+                return true;
+        }
+
+    for (auto Src = memInstructions.begin(); Src != memInstructions.end(); Src++)
+        for (auto Dst = Src; Dst != memInstructions.end(); Dst++){
+            if (isa<LoadInst>(*Src) && isa<LoadInst>(*Dst))
+                continue;
+
+            auto D = DI.depends(*Src, *Dst, true);
+            if (!D)
+                continue;
+            if (D->isConfused() || D->getLevels() < innerLevel)
+                return true;
+
+            unsigned outerDir = D->getDirection(outerLevel);
+            unsigned innerDir = D->getDirection(innerLevel);
+            //The dependence may also be reported from Dst to Src, so (>, <) is mirrored as well
+            if ((outerDir & Dependence::DVEntry::LT) && (innerDir & Dependence::DVEntry::GT))
+                return true;
+            if ((outerDir & Dependence::DVEntry::GT) && (innerDir & Dependence::DVEntry::LT))
+                return true;
+        }
+    return false;
+}
+
+/*
+The unroll factor is the largest one that divides the outer trip count, so that no remainder
+loop is needed and all the inner loop copies end up adjacent in the outer body. It must be smaller
+than the trip count, otherwise UnrollLoop fully unrolls the outer loop and there is no loop to jam
+*/
+unsigned getUnrollFactor(ScalarEvolution &SE, Loop* Outer){
+    unsigned tripCount = SE.getSmallConstantTripCount(Outer);
+
+    //When the header is the exiting block, the last header execution doesn't run the body
+    if (tripCount && Outer->isLoopExiting(Outer->getHeader()))
+        tripCount--;
+
+    for (unsigned factor : {4, 2})
+        if (tripCount > factor && tripCount % factor == 0)
+            return factor;
+    return 0;
+}
+
+/*
+The unrolled outer header and latch end up in the preheaders of the inner loop copies, so they must
+be hoistable by fuseLoops; the copies can only be fused if the inner trip count doesn't depend
+on the outer loop
+*/
+bool canBeJammed(ScalarEvolution &SE, Loop* Outer, Loop* Inner){
+    const SCEV* innerExitCount = SE.getExitCount(Inner, Inner->getExitingBlock());
+    if (isa<SCEVCouldNotCompute>(innerExitCount) || !SE.isLoopInvariant(innerExitCount, Outer))
+        return false;
+
+    auto outsideInner = [Inner](Instruction* OpInst){
+        return !Inner->contains(OpInst);
+    };
+    for (BasicBlock* BB : {Outer->getHeader(), Outer->getLoopLatch()})
+        for (auto& Inst : *BB){
+            if (isa<PHINode>(Inst) || Inst.isTerminator())
+                continue;
+            if (!isHoistableInstruction(Inst, outsideInner))
+                return false;
+        }
+    return true;
+}
+
+/*
+Unroll the outer loop, then fuse every copy of the inner loop into the first one
+*/
+bool unrollAndJam(Function &F, FunctionAnalysisManager &AM, LoopInfo &LI, ScalarEvolution &SE, DominatorTree &DT, PostDominatorTree &PDT, DependenceInfo &DI, Loop* Outer){
+    Loop* Inner = Outer->getSubLoops().front();
+    unsigned factor = getUnrollFactor(SE, Outer);
+
+    if (!factor){
+        outs()<<"No unroll factor divides the outer trip count\n";
+        return false;
+    }
+    if (!canBeJammed(SE, Outer, Inner)){
+        outs()<<"Inner loop copies can NOT be fused\n";
+        return false;
+    }
+    if (haveJamPreventingDependence(DI, Outer, Inner)){
+        outs()<<"Have jam preventing dependencies\n";
+        return false;
+    }
+
+    UnrollLoopOptions ULO;
+    ULO.Count = factor;
+    ULO.Force = false;
+    ULO.Runtime = false;
+    ULO.AllowExpensiveTripCount = false;
+    ULO.UnrollRemainder = false;
+    ULO.ForgetAllSCEV = false;
+
+    AssumptionCache &AC = AM.getResult<AssumptionAnalysis>(F);
+    TargetTransformInfo &TTI = AM.getResult<TargetIRAnalysis>(F);
+    OptimizationRemarkEmitter &ORE = AM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+
+    LoopUnrollResult result = UnrollLoop(Outer, ULO, &LI, &SE, &DT, &AC, &TTI, &ORE, false);
+    if (result == LoopUnrollResult::Unmodified){
+        outs()<<"Outer loop NOT unrolled\n";
+        return false;
+    }
+    if (result == LoopUnrollResult::FullyUnrolled){
+        //Outer has been erased from LoopInfo, there is nothing left to jam
+        outs()<<"Outer loop fully unrolled\n";
+        return true;
+    }
+    outs()<<"Outer loop unrolled by "<<factor<<"\n";
+    PDT.recalculate(F);
+
+    //The inner loop copies are sorted by their position in the unrolled body
+    std::vector<Loop*> copies(Outer->getSubLoops().begin(), Outer->getSubLoops().end());
+    llvm::sort(copies, [&DT](Loop* A, Loop* B){
+        return DT.properlyDominates(A->getHeader(), B->getHeader());
+    });
+
+    //The outer latch and header copies left between two inner loop copies are merged into
+    //the exit block of the previous copy, which becomes the preheader of the next one
+    for (unsigned i = 1; i < copies.size(); i++){
+        BasicBlock* BB = copies[i]->getLoopPreheader();
+        while (BB != copies[i-1]->getExitBlock()){
+            BasicBlock* Pred = BB->getSinglePredecessor();
+            if (!Pred || !MergeBlockIntoPredecessor(BB, nullptr, &LI))
+                break;
+            BB = Pred;
+        }
+    }
+    DT.recalculate(F);
+    PDT.recalculate(F);
+
+    Loop* firstCopy = copies.front();
+    for (unsigned i = 1; i < copies.size(); i++){
+        if (!canBeFused(SE, DT, PDT, DI, firstCopy, copies[i])){
+            //Not expected after canBeJammed: the outer loop stays unrolled, which is still correct
+            outs()<<"Inner loop copies can NOT be fused\n";
+            break;
+        }
+        fuseLoops(firstCopy, copies[i], LI);
+
+        //Header and latch of the fused copy are left unreachable inside the outer loop
+        DT.recalculate(F);
+        for (auto& BB : F)
+            if (!DT.isReachableFromEntry(&BB))
+                LI.removeBlock(&BB);
+        EliminateUnreachableBlocks(F);
+        DT.recalculate(F);
+        PDT.recalculate(F);
+    }
+    SE.forgetLoop(Outer);
+    return true;
+}
+
+PreservedAnalyses LoopUnrollAndJam::run(Function &F,FunctionAnalysisManager &AM) {
+
+    LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+    ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
+    DominatorTree &DT = AM.getResult<DominatorTreeAnalysis>(F);
+    PostDominatorTree &PDT = AM.getResult<PostDominatorTreeAnalysis>(F);
+    DependenceInfo &DI = AM.getResult<DependenceAnalysis>(F);
+
+    bool changed = false;
+
+    //Unrolling adds loops to LoopInfo, so the candidate nests are collected first
+    std::vector<Loop*> nests;
+    for (auto *TopLevelLoop: LI)
+        for (Loop* L : depth_first(TopLevelLoop))
+            if (isPerfectNest(L))
+                nests.push_back(L);
+
+    for (auto *Outer: nests){
+        outs()<<"Nest:\n";
+        Outer->print(outs());
+        changed |= unrollAndJam(F, AM, LI, SE, DT, PDT, DI, Outer);
+        outs()<<"_______________________\n";
+    }
+
+    return changed ? PreservedAnalyses::none() : PreservedAnalyses::all();
+}
@@ -8,12 +8,18 @@
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/DependenceAnalysis.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/UnrollLoop.h"
 
 namespace llvm{
     class LoopFusion: public PassInfoMixin<LoopFusion> {
         public: 
             PreservedAnalyses run(Function &F,FunctionAnalysisManager &AM);
         };
+
+    class LoopUnrollAndJam: public PassInfoMixin<LoopUnrollAndJam> {
+        public: 
+            PreservedAnalyses run(Function &F,FunctionAnalysisManager &AM);
+        };
     } // namespace llvm
 
 #endif // LLVM_TRANSFORMS_LOOPFUSION_H
\ No newline at end of file